@@ -1,17 +1,25 @@
 #include "AVLTree.h"
 
 #include <functional>
+#include <ostream>
 #include <string>
-#include <bits/locale_facets_nonio.h>
 
 // ----CONSTRUCTORS, DESTRUCTOR, ASSIGNMENT OPERATOR---------------------------------------
 
 // Default constructor
-AVLTree::AVLTree() : root(nullptr), treeSize(0) {}
+AVLTree::AVLTree() : root(nullptr), treeSize(0), allDirty(false), trackAggregates(false), hashIndex(nullptr), finger(nullptr),
+                     memoryBytes(0), memoryBudget(0) {}
 
 // Copy constructor
-AVLTree::AVLTree(const AVLTree& other) : root(nullptr), treeSize(other.treeSize) {
+AVLTree::AVLTree(const AVLTree& other) : root(nullptr), treeSize(other.treeSize), allDirty(false),
+                                         trackAggregates(other.trackAggregates), hashIndex(nullptr),
+                                         finger(nullptr), memoryBytes(0), memoryBudget(other.memoryBudget),
+                                         evictionCallback(other.evictionCallback) {
+    other.flushDirty(); // copy up-to-date aggregates
     root = deepCopy(other.root);
+    if (other.hashIndex) {
+        enableHashIndex();
+    }
 }
 
 // operator assignment
@@ -23,8 +31,23 @@ AVLTree& AVLTree::operator=(const AVLTree& other) {
 
     // Free existing tree
     searchAndDestroy(root);
+    dirtyKeys.clear();
+    allDirty = false;
+    finger = nullptr;
+    clockHand.reset();
+    memoryBytes = 0; // deepCopy counts the new nodes
+    memoryBudget = other.memoryBudget;
+    evictionCallback = other.evictionCallback;
+    trackAggregates = other.trackAggregates; // deepCopy allocates aggregates to match
+    other.flushDirty();
     root = deepCopy(other.root); // deep copy from other tree
     treeSize = other.treeSize;
+
+    // index has to point at our own nodes, so rebuild it
+    disableHashIndex();
+    if (other.hashIndex) {
+        enableHashIndex();
+    }
     return *this;
 }
 
@@ -33,6 +56,9 @@ AVLTree::~AVLTree() {
     searchAndDestroy(root);
     root = nullptr;
     treeSize = 0;
+    finger = nullptr;
+    delete hashIndex;
+    hashIndex = nullptr;
 }
 
 // AVLNode methods------------------------------------------------------
@@ -67,6 +93,39 @@ size_t AVLTree::getTreeHeight() const {
     return root ? root->height : 0;
 }
 
+AVLTree::ValueType AVLTree::getHeight() const {
+    return getTreeHeight();
+}
+
+// Recompute height and, when enabled, the subtree sum/min/max from the children.
+// Children must already be up to date, so call this bottom-up.
+// Also points the children back at node.
+void AVLTree::updateNode(AVLNode* node) const {
+    node->height = 1 + std::max(getNodeHeight(node->left), getNodeHeight(node->right));
+
+    if (node->left != nullptr) {
+        node->left->parent = node;
+    }
+    if (node->right != nullptr) {
+        node->right->parent = node;
+    }
+
+    if (node->aggregate == nullptr) {
+        return; // aggregates are off
+    }
+
+    SubtreeAggregate& agg = *node->aggregate;
+    agg = SubtreeAggregate{node->value, node->value, node->value};
+
+    for (AVLNode* child : {node->left, node->right}) {
+        if (child != nullptr) {
+            agg.sum += child->aggregate->sum;
+            agg.min = std::min(agg.min, child->aggregate->min);
+            agg.max = std::max(agg.max, child->aggregate->max);
+        }
+    }
+}
+
 // PUBLIC WRAPPERS----------------------------------------------------------------
 
 // node parameter is always the root node
@@ -74,6 +133,7 @@ bool AVLTree::insert(const KeyType& key, const ValueType& value) {
     bool insert = insertNode(root, key, value);
     if (insert) {
         treeSize++;
+        enforceBudget(finger); // finger is the new node
     }
 
     return insert;
@@ -89,30 +149,58 @@ bool AVLTree::remove(const KeyType& key) {
 }
 
 bool AVLTree::contains(const KeyType& key) const {
+    if (hashIndex) {
+        AVLNode* node = hashIndex->find(key);
+        if (node == nullptr) {
+            return false;
+        }
+        markUsed(node);
+        return true;
+    }
     return containsNode(root, key);
 }
 
 optional<size_t> AVLTree::get(const KeyType& key) const {
+    if (hashIndex) {
+        AVLNode* node = hashIndex->find(key);
+        if (node == nullptr) {
+            return nullopt;
+        }
+        markUsed(node);
+        return node->value;
+    }
     return getNode(root, key);
 }
 
 size_t& AVLTree::operator[](const KeyType& key) {
 
-    // if node exists, return reference to it
-    // if it does not exist, insert a default value of 0 and return
-    AVLNode* nodeFound = nodeOperator(root, key);
-    if (nodeFound) {
-        return nodeFound->value;
+    // caller may write through the returned reference, now or after later calls
+    if (trackAggregates && !allDirty) {
+        if (dirtyKeys.size() >= max<size_t>(treeSize, 16)) {
+            allDirty = true; // cheaper to redo every node than each path
+            dirtyKeys.clear();
+        } else {
+            dirtyKeys.push_back(key);
+        }
     }
 
-    // insert default
-    bool insert = insertNode(root, key, ValueType(0));
-    if (insert) {
-        treeSize++;
+    // existing key: the index skips the tree walk
+    if (hashIndex) {
+        AVLNode* nodeFound = hashIndex->find(key);
+        if (nodeFound) {
+            finger = nodeFound;
+            markUsed(nodeFound);
+            return nodeFound->value;
+        }
     }
 
-    // Got-em
-    nodeFound = nodeOperator(root, key);
+    // if node exists, return reference to it
+    // if it does not exist, insert a default value of 0 and return
+    // (nodeOperator does the insert and counts it in treeSize)
+    AVLNode* nodeFound = nodeOperator(root, key);
+    finger = nodeFound;
+    markUsed(nodeFound);
+    enforceBudget(nodeFound); // the returned reference has to stay valid
     return nodeFound->value;
 }
 
@@ -125,6 +213,40 @@ vector<size_t> AVLTree::findRange(const KeyType& lowKey, const KeyType& highKey)
     return res;
 }
 
+size_t AVLTree::rangeSum(const KeyType& lowKey, const KeyType& highKey) const {
+    flushDirty();
+    Aggregate acc;
+    aggregateRange(root, lowKey, highKey, true, true, acc);
+    return acc.sum;
+}
+
+optional<size_t> AVLTree::rangeMin(const KeyType& lowKey, const KeyType& highKey) const {
+    flushDirty();
+    Aggregate acc;
+    aggregateRange(root, lowKey, highKey, true, true, acc);
+    if (acc.empty) {
+        return nullopt;
+    }
+    return acc.min;
+}
+
+optional<size_t> AVLTree::rangeMax(const KeyType& lowKey, const KeyType& highKey) const {
+    flushDirty();
+    Aggregate acc;
+    aggregateRange(root, lowKey, highKey, true, true, acc);
+    if (acc.empty) {
+        return nullopt;
+    }
+    return acc.max;
+}
+
+vector<string> AVLTree::findOverlapping(const KeyType& highKey, const ValueType& lowValue) const {
+    flushDirty(); // pruning reads the stored max
+    vector<KeyType> res;
+    findOverlappingHelper(root, highKey, lowValue, res);
+    return res;
+}
+
 size_t AVLTree::size() const {
     return treeSize; // insert treeSize++, delete treeSize--
 }
@@ -143,6 +265,14 @@ bool AVLTree::insertNode(AVLNode*& current, const KeyType& key, const ValueType&
     if (current == nullptr) {
         current = new AVLNode{key, value};
         current->height = 1;
+        if (trackAggregates) {
+            current->aggregate = new SubtreeAggregate{value, value, value};
+        }
+        if (hashIndex) {
+            hashIndex->put(current);
+        }
+        memoryBytes += nodeBytes(current);
+        finger = current;
         return true; // go back to parent now
     }
 
@@ -164,16 +294,8 @@ bool AVLTree::insertNode(AVLNode*& current, const KeyType& key, const ValueType&
         return false;
     }
 
-    size_t leftHeight = 0, rightHeight = 0;
-    if (current->left != nullptr) {
-        leftHeight = current->left->getHeight();
-    }
-
-    if (current->right != nullptr) {
-        rightHeight = current->right->getHeight();
-    }
-
-    current->height = 1 + std::max(leftHeight, rightHeight);
+    // Update height and aggregates on the way back up
+    updateNode(current);
 
     // Rebalance
     balanceNode(current);
@@ -195,10 +317,16 @@ bool AVLTree::removeNode(AVLNode*& current){
     // CASE ONE: NO CHILD
     if (current->isLeaf()) {
         // case 1 we can delete the node
+        if (hashIndex) {
+            hashIndex->erase(current->key, current);
+        }
+        if (finger == current) {
+            finger = nullptr;
+        }
+        memoryBytes -= nodeBytes(current);
         delete current;
         current = nullptr; // Parent pointer points to nullptr now
-        treeSize--;
-        return true;
+        return true; // public remove() does treeSize--
     }
 
     // CASE 2: ONE CHILD
@@ -213,9 +341,16 @@ bool AVLTree::removeNode(AVLNode*& current){
             child = current->right;
         }
 
+        if (hashIndex) {
+            hashIndex->erase(current->key, current);
+        }
+        if (finger == current) {
+            finger = nullptr;
+        }
+        child->parent = current->parent;
+        memoryBytes -= nodeBytes(current);
         delete current; // Delete original node
         current = child; // Replace node with its child
-        treeSize--;
         return true;
     }
     // CASE 3: TWO CHILDREN
@@ -232,8 +367,21 @@ bool AVLTree::removeNode(AVLNode*& current){
         // Copy successor pair into this current node
         std::string newKey = smallestInRight->key;
         size_t newValue = smallestInRight->value;
+        if (hashIndex) {
+            hashIndex->erase(current->key, current);
+        }
+        memoryBytes -= nodeBytes(current); // key storage may change size
         current->key = newKey;
         current->value = newValue;
+        current->referenced = smallestInRight->referenced; // CLOCK bit travels with the entry
+        memoryBytes += nodeBytes(current);
+        // successor key now lives here, the successor node's own erase below will skip it
+        if (hashIndex) {
+            hashIndex->put(current);
+        }
+        if (finger == smallestInRight) {
+            finger = current;
+        }
 
         // DON'T NEED THIS: my remove function will utilize balance and height
         // current->height = current->getHeight();
@@ -242,6 +390,10 @@ bool AVLTree::removeNode(AVLNode*& current){
     // Remove successor node from the right subtree
     bool removedNode = remove(current->right, smallestInRight->key);
 
+    // current now holds the successor's value and lost a node on the right
+    updateNode(current);
+    balanceNode(current);
+
     return removedNode;
 
     }
@@ -264,17 +416,8 @@ bool AVLTree::remove(AVLNode*& current, KeyType key) {
         }
 
         // ---POST NODE DELETION--- //
-        // Node was removed->update height and rebalance
-        size_t leftHeight = 0, rightHeight = 0;
-        if (current->left != nullptr) {
-            leftHeight = current->left->getHeight();
-        }
-
-        if (current->right != nullptr) {
-            rightHeight = current->right->getHeight();
-        }
-
-        current->height = 1 + std::max(leftHeight, rightHeight);
+        // Node was removed->update height, aggregates and rebalance
+        updateNode(current);
 
         balanceNode(current);
 
@@ -288,17 +431,8 @@ bool AVLTree::remove(AVLNode*& current, KeyType key) {
             return false;
         }
 
-        // Update height and rebalance
-        size_t leftHeight = 0, rightHeight = 0;
-        if (current->left != nullptr) {
-            leftHeight = current->left->getHeight();
-        }
-
-        if (current->right != nullptr) {
-            rightHeight = current->right->getHeight();
-        }
-
-        current->height = 1 + std::max(leftHeight, rightHeight);
+        // Update height, aggregates and rebalance
+        updateNode(current);
 
         balanceNode(current);
         return true;
@@ -373,9 +507,11 @@ void AVLTree::rotateToRight(AVLNode*& node) {
     // Rotate
     hook->right = node; //hook becomes the root: right of B is now A
     node->left = hookRight; // Right node from hook rotates left of prev root node (left of A is D)
+    hook->parent = node->parent; // hook takes A's place under A's parent
 
-    node->height = 1 + std::max(getNodeHeight(node->left), getNodeHeight(node->right));
-    hook->height = 1 + std::max(getNodeHeight(hook->left), getNodeHeight(hook->right));
+    // old root is now a child of hook, so update it first
+    updateNode(node);
+    updateNode(hook);
 
     node = hook; // hook becomes new root
 
@@ -391,9 +527,11 @@ void AVLTree::rotateToLeft(AVLNode*& node) {
     // Rotate
     hook->left = node; //hook becomes the root: left of B is now A
     node->right = hookLeft; // Left node from hook rotates right of prev root node (right of A is D)
+    hook->parent = node->parent; // hook takes A's place under A's parent
 
-    node->height = 1 + std::max(getNodeHeight(node->left), getNodeHeight(node->right));
-    hook->height = 1 + std::max(getNodeHeight(hook->left), getNodeHeight(hook->right));
+    // old root is now a child of hook, so update it first
+    updateNode(node);
+    updateNode(hook);
 
     node = hook; // hook becomes new root
 
@@ -409,6 +547,7 @@ bool AVLTree::containsNode(AVLNode* node, const KeyType& key) const {
 
     // if key is in the tree, return true
     if (key == node->key) {
+        markUsed(node);
         return true;
     }
     else if (key < node->key) {
@@ -429,6 +568,7 @@ optional<size_t> AVLTree::getNode(AVLNode* node, const KeyType& key) const {
 
     // Key found return val
     if (key == node->key) {
+        markUsed(node);
         return node->value;
     }
 
@@ -446,12 +586,21 @@ AVLTree::AVLNode* AVLTree::nodeOperator(AVLNode*& node, const KeyType& key) {
     if (node == nullptr) {
         node = new AVLNode(key, 0);
         node->height = 1;
+        if (trackAggregates) {
+            node->aggregate = new SubtreeAggregate{0, 0, 0};
+        }
+        treeSize++;
+        memoryBytes += nodeBytes(node);
+        if (hashIndex) {
+            hashIndex->put(node);
+        }
         return node;
     }
 
     // left
     if (key < node->key) {
         AVLNode* newNode = nodeOperator(node->left, key);
+        updateNode(node);
         balanceNode(node);
         return newNode;
     }
@@ -459,6 +608,7 @@ AVLTree::AVLNode* AVLTree::nodeOperator(AVLNode*& node, const KeyType& key) {
     // right
     if (key > node->key) {
         AVLNode* newNode = nodeOperator(node->right, key);
+        updateNode(node);
         balanceNode(node);
         return newNode;
     }
@@ -466,6 +616,176 @@ AVLTree::AVLNode* AVLTree::nodeOperator(AVLNode*& node, const KeyType& key) {
     return node; // key exists already, so return existing node
 }
 
+// Finger helpers------------------------------------------------------------
+
+bool AVLTree::insert(const KeyType& hint, const KeyType& key, const ValueType& value) {
+    AVLNode* bound = nullptr;
+    AVLNode* start = fingerStart(hint, key, bound);
+    if (start == nullptr) {
+        return insert(key, value); // empty tree
+    }
+    if (bound && bound->key == key) {
+        finger = bound;
+        return false; // duplicate
+    }
+
+    // insert and rebalance inside start's subtree, then fix the ancestors above it
+    AVLNode*& link = linkOf(start);
+    if (!insertNode(link, key, value)) {
+        return false;
+    }
+    treeSize++;
+    rebalanceUp(link->parent);
+    enforceBudget(finger); // finger is the new node
+    return true;
+}
+
+optional<string> AVLTree::lower_bound(const KeyType& hint, const KeyType& key) const {
+    AVLNode* bound = nullptr;
+    AVLNode* start = fingerStart(hint, key, bound);
+    return lowerBoundFrom(start, bound, key);
+}
+
+optional<string> AVLTree::lower_bound(const KeyType& key) const {
+    return lowerBoundFrom(root, nullptr, key);
+}
+
+optional<size_t> AVLTree::get(const KeyType& hint, const KeyType& key) const {
+    AVLNode* bound = nullptr;
+    AVLNode* start = fingerStart(hint, key, bound);
+    AVLNode* found = lowerBoundNode(start, bound, key);
+    if (found == nullptr) {
+        return nullopt;
+    }
+    finger = found; // a miss still leaves the finger next to key
+    if (found->key != key) {
+        return nullopt;
+    }
+    markUsed(found);
+    return found->value;
+}
+
+/**
+ *(helper)
+ *Pick the node to search from for key.
+ *The walk starts at the node holding hint: the finger if it is on hint, else
+ *the index entry for hint, else hint's lower bound reached from the finger.
+ *With no finger, or hint past the largest key, it starts at root.
+ */
+AVLTree::AVLNode* AVLTree::fingerStart(const KeyType& hint, const KeyType& key, AVLNode*& bound) const {
+    bound = nullptr;
+    AVLNode* start = finger && finger->key == hint ? finger : nullptr;
+    if (start == nullptr && hashIndex) {
+        start = hashIndex->find(hint);
+    }
+    if (start == nullptr && finger) {
+        AVLNode* hintBound = nullptr;
+        start = lowerBoundNode(climbToward(finger, hint, hintBound), hintBound, hint);
+    }
+    if (start == nullptr) {
+        return root;
+    }
+    return climbToward(start, key, bound);
+}
+
+/**
+ *(helper)
+ *Going right, climb to the first ancestor start's subtree hangs left of.
+ *If that ancestor's key is >= key, key belongs in the subtree we came from.
+ *Otherwise carry on from the ancestor.
+ *Ancestors passed on the way up are on the wrong side of start, so only the
+ *turning points cost a comparison. Going left is the mirror image.
+ *bound is set to the ancestor that stopped the climb (it may equal key).
+ */
+AVLTree::AVLNode* AVLTree::climbToward(AVLNode* start, const KeyType& key, AVLNode*& bound) const {
+    bound = nullptr;
+    if (key == start->key) {
+        return start;
+    }
+    bool goingRight = start->key < key;
+
+    while (true) {
+        // climb past ancestors on start's side
+        AVLNode* child = start;
+        AVLNode* ancestor = start->parent;
+        while (ancestor && (goingRight ? ancestor->right : ancestor->left) == child) {
+            child = ancestor;
+            ancestor = ancestor->parent;
+        }
+
+        // nothing beyond start's subtree in that direction
+        if (ancestor == nullptr) {
+            return start;
+        }
+
+        // key is between start and ancestor
+        if (goingRight ? !(ancestor->key < key) : !(key < ancestor->key)) {
+            bound = ancestor;
+            return start;
+        }
+
+        start = ancestor;
+    }
+}
+
+optional<string> AVLTree::lowerBoundFrom(AVLNode* node, AVLNode* bound, const KeyType& key) const {
+    AVLNode* found = lowerBoundNode(node, bound, key);
+    if (found == nullptr) {
+        return nullopt;
+    }
+    finger = found;
+    markUsed(found);
+    return found->key;
+}
+
+AVLTree::AVLNode* AVLTree::lowerBoundNode(AVLNode* node, AVLNode* bound, const KeyType& key) const {
+    if (bound && bound->key == key) {
+        return bound;
+    }
+
+    AVLNode* best = nullptr;
+    while (node != nullptr) {
+        if (node->key < key) {
+            node = node->right;
+        } else {
+            best = node;
+            if (node->key == key) {
+                break;
+            }
+            node = node->left;
+        }
+    }
+
+    // everything in the searched subtree is smaller, the bound is next
+    if (best == nullptr && bound && key < bound->key) {
+        best = bound;
+    }
+    return best;
+}
+
+AVLTree::AVLNode*& AVLTree::linkOf(AVLNode* node) {
+    if (node->parent == nullptr) {
+        return root;
+    }
+    return node->parent->left == node ? node->parent->left : node->parent->right;
+}
+
+void AVLTree::rebalanceUp(AVLNode* node) {
+    while (node != nullptr) {
+        AVLNode*& link = linkOf(node);
+        size_t oldHeight = node->height; // not yet updated for the insert below it
+        updateNode(node);
+        balanceNode(link);
+
+        // Subtree kept its height (unchanged, or restored by a rotation): nothing
+        // above can change, unless aggregates still have to be carried up
+        if (!trackAggregates && link->height == oldHeight) {
+            return;
+        }
+        node = link->parent;
+    }
+}
+
 // Range and key helpers------------------------------------------------------
 
 /**
@@ -508,6 +828,507 @@ void AVLTree::getKeys(AVLNode* node, vector<KeyType>& vec) const {
     getKeys(node->right, vec);
 }
 
+/**
+ *(helper)
+ *checkLow/checkHigh say whether this subtree can still hold keys outside the range.
+ *Once both are false the whole subtree is in range and its stored aggregate is used,
+ *so only the two boundary paths are walked. Without stored aggregates the in-range
+ *subtrees are walked node by node instead.
+ */
+void AVLTree::aggregateRange(AVLNode* node, const KeyType& lowKey, const KeyType& highKey,
+                             bool checkLow, bool checkHigh, Aggregate& acc) const {
+    if (node == nullptr) {
+        return;
+    }
+
+    // Entire subtree is in range
+    if (!checkLow && !checkHigh && node->aggregate != nullptr) {
+        if (acc.empty) {
+            acc.min = node->aggregate->min;
+            acc.max = node->aggregate->max;
+        } else {
+            acc.min = std::min(acc.min, node->aggregate->min);
+            acc.max = std::max(acc.max, node->aggregate->max);
+        }
+        acc.sum += node->aggregate->sum;
+        acc.empty = false;
+        return;
+    }
+
+    // Node is too small, only the right subtree can be in range
+    if (checkLow && node->key < lowKey) {
+        aggregateRange(node->right, lowKey, highKey, checkLow, checkHigh, acc);
+        return;
+    }
+
+    // Node is too big, only the left subtree can be in range
+    if (checkHigh && node->key > highKey) {
+        aggregateRange(node->left, lowKey, highKey, checkLow, checkHigh, acc);
+        return;
+    }
+
+    // Node is in range: everything on the left is <= highKey,
+    // everything on the right is >= lowKey
+    aggregateRange(node->left, lowKey, highKey, checkLow, false, acc);
+
+    if (acc.empty) {
+        acc.min = node->value;
+        acc.max = node->value;
+    } else {
+        acc.min = std::min(acc.min, node->value);
+        acc.max = std::max(acc.max, node->value);
+    }
+    acc.sum += node->value;
+    acc.empty = false;
+
+    aggregateRange(node->right, lowKey, highKey, false, checkHigh, acc);
+}
+
+// Re-aggregate every node on the path from node down to key (bottom-up)
+void AVLTree::refreshPath(AVLNode* node, const KeyType& key) const {
+    if (node == nullptr) {
+        return;
+    }
+
+    if (key < node->key) {
+        refreshPath(node->left, key);
+    } else if (key > node->key) {
+        refreshPath(node->right, key);
+    }
+
+    updateNode(node);
+}
+
+// In-order walk that stops at the first key past highKey and, with aggregates,
+// skips subtrees whose largest value is below lowValue
+void AVLTree::findOverlappingHelper(AVLNode* node, const KeyType& highKey, const ValueType& lowValue,
+                                    vector<KeyType>& res) const {
+    if (node == nullptr) {
+        return;
+    }
+    if (node->aggregate && node->aggregate->max < lowValue) {
+        return; // nothing in this subtree reaches lowValue
+    }
+
+    findOverlappingHelper(node->left, highKey, lowValue, res);
+
+    // everything from here on (node and its right subtree) starts after highKey
+    if (node->key > highKey) {
+        return;
+    }
+    if (node->value >= lowValue) {
+        res.push_back(node->key);
+    }
+
+    findOverlappingHelper(node->right, highKey, lowValue, res);
+}
+
+// post-order so children are aggregated before their parent
+void AVLTree::refreshAll(AVLNode* node) const {
+    if (node == nullptr) {
+        return;
+    }
+    refreshAll(node->left);
+    refreshAll(node->right);
+    updateNode(node);
+}
+
+void AVLTree::flushDirty() const {
+    if (allDirty) {
+        refreshAll(root);
+        allDirty = false;
+        return;
+    }
+    for (const KeyType& key : dirtyKeys) {
+        refreshPath(root, key);
+    }
+    dirtyKeys.clear();
+}
+
+void AVLTree::enableAggregates() {
+    if (trackAggregates) {
+        return;
+    }
+    trackAggregates = true;
+    setAggregates(root, true);
+    enforceBudget(nullptr); // aggregates count against the budget
+}
+
+void AVLTree::disableAggregates() {
+    if (!trackAggregates) {
+        return;
+    }
+    trackAggregates = false;
+    dirtyKeys.clear();
+    allDirty = false;
+    setAggregates(root, false);
+}
+
+bool AVLTree::hasAggregates() const {
+    return trackAggregates;
+}
+
+// post-order so children are aggregated before their parent
+void AVLTree::setAggregates(AVLNode* node, bool enable) {
+    if (node == nullptr) {
+        return;
+    }
+    setAggregates(node->left, enable);
+    setAggregates(node->right, enable);
+
+    memoryBytes -= nodeBytes(node);
+    if (enable) {
+        node->aggregate = new SubtreeAggregate{0, 0, 0};
+        updateNode(node);
+    } else {
+        delete node->aggregate;
+        node->aggregate = nullptr;
+    }
+    memoryBytes += nodeBytes(node);
+}
+
+// Invariant checks------------------------------------------------------------
+
+bool AVLTree::isValid() const {
+    flushDirty();
+    size_t count = 0, bytes = 0;
+    if (root && root->parent != nullptr) {
+        return false;
+    }
+    if (!checkNode(root, nullptr, nullptr, count, bytes)) {
+        return false;
+    }
+    if (bytes != memoryBytes) {
+        return false;
+    }
+    if (hashIndex && hashIndex->size() != treeSize) {
+        return false;
+    }
+    return count == treeSize;
+}
+
+/**
+ *(helper)
+ *low/high are the keys of the nearest ancestors this subtree hangs right/left of,
+ *every key in the subtree must be strictly between them (nullptr = unbounded)
+ */
+bool AVLTree::checkNode(AVLNode* node, const KeyType* low, const KeyType* high,
+                        size_t& count, size_t& bytes) const {
+    if (node == nullptr) {
+        return true;
+    }
+
+    // BST ordering
+    if ((low && node->key <= *low) || (high && node->key >= *high)) {
+        return false;
+    }
+
+    // index entry must point at this node
+    if (hashIndex && hashIndex->find(node->key) != node) {
+        return false;
+    }
+
+    // children must point back up
+    if ((node->left && node->left->parent != node) || (node->right && node->right->parent != node)) {
+        return false;
+    }
+
+    if (!checkNode(node->left, low, &node->key, count, bytes) ||
+        !checkNode(node->right, &node->key, high, count, bytes)) {
+        return false;
+    }
+    count++;
+    bytes += nodeBytes(node);
+
+    // stored height
+    int leftHeight = getNodeHeight(node->left);
+    int rightHeight = getNodeHeight(node->right);
+    if (node->getHeight() != size_t(1 + std::max(leftHeight, rightHeight))) {
+        return false;
+    }
+
+    // AVL balance
+    if (leftHeight - rightHeight > 1 || rightHeight - leftHeight > 1) {
+        return false;
+    }
+
+    // subtree aggregates, on every node or none
+    if ((node->aggregate != nullptr) != trackAggregates) {
+        return false;
+    }
+    if (!trackAggregates) {
+        return true;
+    }
+    ValueType sum = node->value, min = node->value, max = node->value;
+    for (AVLNode* child : {node->left, node->right}) {
+        if (child != nullptr) {
+            sum += child->aggregate->sum;
+            min = std::min(min, child->aggregate->min);
+            max = std::max(max, child->aggregate->max);
+        }
+    }
+    const SubtreeAggregate& agg = *node->aggregate;
+    return agg.sum == sum && agg.min == min && agg.max == max;
+}
+
+// Hash index----------------------------------------------------------------
+
+void AVLTree::enableHashIndex() {
+    if (hashIndex) {
+        return;
+    }
+    hashIndex = new HashIndex();
+    indexNodes(root);
+    enforceBudget(nullptr); // index counts against the budget
+}
+
+void AVLTree::disableHashIndex() {
+    delete hashIndex;
+    hashIndex = nullptr;
+}
+
+bool AVLTree::hasHashIndex() const {
+    return hashIndex != nullptr;
+}
+
+size_t AVLTree::hashIndexBytes() const {
+    return hashIndex ? hashIndex->bytes() : 0;
+}
+
+void AVLTree::indexNodes(AVLNode* node) {
+    if (node == nullptr) {
+        return;
+    }
+    hashIndex->put(node);
+    indexNodes(node->left);
+    indexNodes(node->right);
+}
+
+AVLTree::HashIndex::HashIndex() : slots(16, Slot{0, nullptr}), count(0) {}
+
+size_t AVLTree::HashIndex::findSlot(const KeyType& key, size_t hash) const {
+    size_t mask = slots.size() - 1;
+    size_t i = hash & mask;
+    // load factor is capped below 1, so an empty slot always ends the probe
+    while (slots[i].node != nullptr) {
+        if (slots[i].hash == hash && slots[i].node->key == key) {
+            return i;
+        }
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+AVLTree::AVLNode* AVLTree::HashIndex::find(const KeyType& key) const {
+    return slots[findSlot(key, std::hash<KeyType>{}(key))].node;
+}
+
+void AVLTree::HashIndex::put(AVLNode* node) {
+    // keep load factor <= 0.7
+    if ((count + 1) * 10 > slots.size() * 7) {
+        rehash(slots.size() * 2);
+    }
+
+    size_t hash = std::hash<KeyType>{}(node->key);
+    size_t i = findSlot(node->key, hash);
+    if (slots[i].node == nullptr) {
+        count++;
+    }
+    slots[i] = Slot{hash, node};
+}
+
+void AVLTree::HashIndex::erase(const KeyType& key, const AVLNode* node) {
+    size_t mask = slots.size() - 1;
+    size_t i = findSlot(key, std::hash<KeyType>{}(key));
+    if (slots[i].node != node) {
+        return; // missing, or key moved to another node
+    }
+
+    // Backward shift: pull later entries of the cluster into the hole
+    // so lookups never need tombstones
+    size_t j = i;
+    while (true) {
+        j = (j + 1) & mask;
+        if (slots[j].node == nullptr) {
+            break;
+        }
+        size_t home = slots[j].hash & mask;
+        // entry at j may move to i if i lies on its probe path (home..j)
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            slots[i] = slots[j];
+            i = j;
+        }
+    }
+    slots[i] = Slot{0, nullptr};
+    count--;
+
+    // below 0.2 load, halve (lands under 0.4, well clear of the 0.7 grow point)
+    if (slots.size() > 16 && count * 10 < slots.size() * 2) {
+        rehash(slots.size() / 2);
+    }
+}
+
+void AVLTree::HashIndex::compact() {
+    size_t newSize = 16;
+    while (count * 10 > newSize * 7) {
+        newSize *= 2;
+    }
+    if (newSize < slots.size()) {
+        rehash(newSize);
+    }
+}
+
+size_t AVLTree::HashIndex::size() const {
+    return count;
+}
+
+size_t AVLTree::HashIndex::bytes() const {
+    return sizeof(HashIndex) + slots.capacity() * sizeof(Slot);
+}
+
+
+// newSize must be a power of two with room for every entry
+void AVLTree::HashIndex::rehash(size_t newSize) {
+    vector<Slot> old(newSize, Slot{0, nullptr});
+    old.swap(slots);
+
+    size_t mask = slots.size() - 1;
+    for (const Slot& slot : old) {
+        if (slot.node == nullptr) {
+            continue;
+        }
+        size_t i = slot.hash & mask;
+        while (slots[i].node != nullptr) {
+            i = (i + 1) & mask;
+        }
+        slots[i] = slot;
+    }
+}
+
+// Memory budget and eviction---------------------------------------------------
+
+size_t AVLTree::memoryUsage() const {
+    return memoryBytes + hashIndexBytes();
+}
+
+void AVLTree::setMemoryBudget(size_t bytes) {
+    memoryBudget = bytes;
+    enforceBudget(nullptr);
+}
+
+// Set the CLOCK bit, only while a budget is set: without one no sweep reads it
+// and plain lookups stay read-only
+void AVLTree::markUsed(AVLNode* node) const {
+    if (memoryBudget != 0) {
+        node->referenced = true;
+    }
+}
+
+size_t AVLTree::getMemoryBudget() const {
+    return memoryBudget;
+}
+
+void AVLTree::setEvictionCallback(EvictionCallback callback) {
+    evictionCallback = std::move(callback);
+}
+
+// Node allocation plus the key's heap buffer and the subtree aggregate, if any.
+// Short keys are stored inside the string object itself (SSO) and cost nothing extra.
+size_t AVLTree::nodeBytes(const AVLNode* node) {
+    const char* data = node->key.data();
+    const char* object = reinterpret_cast<const char*>(&node->key);
+    bool inlineKey = data >= object && data < object + sizeof(node->key);
+    size_t aggregateBytes = node->aggregate ? sizeof(SubtreeAggregate) : 0;
+    return sizeof(AVLNode) + (inlineKey ? 0 : node->key.capacity() + 1) + aggregateBytes;
+}
+
+void AVLTree::enforceBudget(AVLNode* keep) {
+    if (memoryBudget == 0 || memoryUsage() <= memoryBudget) {
+        return;
+    }
+
+    // The index may still be sized for an earlier, bigger tree. That is not the
+    // entries' fault, so shrink it before evicting anything.
+    if (hashIndex) {
+        hashIndex->compact();
+    }
+
+    // Best effort: a budget below what keep (or an empty index) needs can't be met,
+    // but evicting everything else still stops the tree from growing past it
+
+    while (memoryUsage() > memoryBudget && root != nullptr) {
+        AVLNode* victim = clockVictim(keep);
+        if (victim == nullptr) {
+            return; // only keep is left
+        }
+
+        // copy out first, remove() may reuse the victim node for its successor
+        KeyType key = victim->key;
+        ValueType value = victim->value;
+        if (evictionCallback) {
+            evictionCallback(key, value);
+        }
+        remove(key);
+    }
+}
+
+/**
+ *(helper)
+ *CLOCK over the keys in order: starting at the hand, clear referenced bits until
+ *an unreferenced entry turns up, wrapping around at the end. Two passes are always
+ *enough, after the first every bit is clear.
+ *Skips keep, and any two-child node whose successor is keep because removing it
+ *would move keep's entry into it and free keep's node.
+ */
+AVLTree::AVLNode* AVLTree::clockVictim(AVLNode* keep) {
+    AVLNode* first = root;
+    while (first->left != nullptr) {
+        first = first->left;
+    }
+
+    AVLNode* node = clockHand ? lowerBoundNode(root, nullptr, *clockHand) : nullptr;
+    if (node == nullptr) {
+        node = first;
+    }
+
+    for (size_t step = 0; step <= 2 * treeSize; step++) {
+        AVLNode* next = successor(node);
+        bool protectedNode = node == keep || (node->numChildren() == 2 && next == keep);
+
+        if (!protectedNode) {
+            if (!node->referenced) {
+                // hand moves past the victim
+                if (next) {
+                    clockHand = next->key;
+                } else {
+                    clockHand.reset();
+                }
+                return node;
+            }
+            node->referenced = false;
+        }
+
+        node = next ? next : first;
+    }
+    return nullptr;
+}
+
+AVLTree::AVLNode* AVLTree::successor(AVLNode* node) const {
+    if (node->right != nullptr) {
+        node = node->right;
+        while (node->left != nullptr) {
+            node = node->left;
+        }
+        return node;
+    }
+
+    // climb until we come up from a left child
+    while (node->parent != nullptr && node->parent->right == node) {
+        node = node->parent;
+    }
+    return node->parent;
+}
+
 // Deep copy and destroy-------------------------------------------------------
 // Private helper for copy constructor
 AVLTree::AVLNode* AVLTree::deepCopy(AVLNode* node) {
@@ -518,6 +1339,11 @@ AVLTree::AVLNode* AVLTree::deepCopy(AVLNode* node) {
 
     // Create node with the same parameters
     AVLNode* newNode = new AVLNode(node->key, node->value, node->height, nullptr, nullptr);
+    newNode->referenced = node->referenced;
+    if (trackAggregates) {
+        newNode->aggregate = new SubtreeAggregate{0, 0, 0}; // filled by updateNode below
+    }
+    memoryBytes += nodeBytes(newNode);
 
     // Copy left subtree
     newNode->left = deepCopy(node->left);
@@ -525,6 +1351,8 @@ AVLTree::AVLNode* AVLTree::deepCopy(AVLNode* node) {
     // Copy right subtree
     newNode->right = deepCopy(node->right);
 
+    updateNode(newNode);
+
     return newNode;
 }
 
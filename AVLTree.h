@@ -4,7 +4,9 @@
 
 #ifndef AVLTREE_H
 #define AVLTREE_H
+#include <functional>
 #include <optional>
+#include <ostream>
 #include <string>
 #include <vector>
 
@@ -14,6 +16,8 @@ class AVLTree {
 public:
     using KeyType = std::string;
     using ValueType = size_t;
+    // gets each entry the budget evicts, before it is removed (e.g. to spill it to disk)
+    using EvictionCallback = function<void(const KeyType& key, const ValueType& value)>;
 
     bool insert(const KeyType& key, const ValueType&); // insert method
     bool remove(const KeyType& key); // remove method
@@ -23,6 +27,38 @@ public:
     size_t& operator[](const KeyType& key);
 
     vector<size_t> findRange(const KeyType& lowKey, const KeyType& highKey) const;
+
+    // finger (hinted) operations: the search starts at hint's node instead of at root.
+    // That is free when hint is the key of the last node inserted, looked up or bound by
+    // operator[] (the finger), O(1) through the hash index, and otherwise a finger search
+    // from the last node to hint (hint need not be in the tree). No finger, or a hint past
+    // the largest key, starts at root. From there it climbs parent pointers to the first
+    // ancestor whose subtree can hold key, comparing only where the path turns, so nearby
+    // keys need few comparisons (the climb itself may still pass O(log n) ancestors).
+    // With aggregates off, a hinted insert stops fixing heights at the first ancestor
+    // whose height did not change, so appends rebalance in amortized O(1); with
+    // aggregates on it updates every ancestor, O(log n).
+    bool insert(const KeyType& hint, const KeyType& key, const ValueType& value);
+    optional<KeyType> lower_bound(const KeyType& hint, const KeyType& key) const; // smallest key >= key
+    optional<KeyType> lower_bound(const KeyType& key) const;
+    optional<ValueType> get(const KeyType& hint, const KeyType& key) const;
+
+    // range aggregates over values with lowKey <= key <= highKey: O(log n) while
+    // aggregates are enabled, otherwise the range is walked in O(log n + k).
+    // Writes through operator[] references are picked up by the next query; a write
+    // made after that query, through a reference obtained before it, is not seen.
+    ValueType rangeSum(const KeyType& lowKey, const KeyType& highKey) const;
+    optional<ValueType> rangeMin(const KeyType& lowKey, const KeyType& highKey) const;
+    optional<ValueType> rangeMax(const KeyType& lowKey, const KeyType& highKey) const;
+
+    // interval overlap: with each entry stored as key = start, value = end, returns in
+    // key order the keys of every interval with start <= highKey and end >= lowValue,
+    // the intervals overlapping the query [lowValue, highKey] when keys and values use
+    // the same scale (e.g. zero padded numbers as keys).
+    // With aggregates on, subtrees whose max end is below lowValue are skipped,
+    // O((k + 1) log n); otherwise every key <= highKey is visited.
+    vector<KeyType> findOverlapping(const KeyType& highKey, const ValueType& lowValue) const;
+
     vector<string> keys() const;
     size_t size() const; // O(1)
     ValueType getHeight() const; // Height of entire tree
@@ -34,18 +70,67 @@ public:
 
     size_t getTreeHeight() const;
 
+    // true if ordering, heights, AVL balance, aggregates and size() all check out, O(n)
+    bool isValid() const;
+
+    // optional hash index: get/contains/operator[] on existing keys become O(1) expected,
+    // ordered queries (findRange, keys) still use the tree
+    void enableHashIndex();
+    void disableHashIndex();
+    bool hasHashIndex() const;
+    size_t hashIndexBytes() const; // heap + object bytes of the index, 0 when disabled
+
+    // optional augmented mode: every node keeps the sum/min/max of its subtree so the
+    // range aggregates above run in O(log n). Off by default, it costs memory per node
+    // and keeps every insert/remove updating all the way to the root.
+    void enableAggregates();
+    void disableAggregates();
+    bool hasAggregates() const;
+
+    // memory accounting and budget
+    // memoryUsage() = node allocations + heap key storage (short keys live inside the
+    // node) + hash index, allocator overhead not included
+    size_t memoryUsage() const;
+    // 0 = unlimited. Over budget, cold entries are evicted with a CLOCK sweep in key
+    // order; get/contains/operator[]/lower_bound mark an entry as recently used, new
+    // entries start cold so a stream of inserts cannot push out entries still in use.
+    // The entry just inserted or returned by operator[] is never evicted, so a budget
+    // smaller than that entry (plus an empty hash index) leaves at most that one entry.
+    void setMemoryBudget(size_t bytes);
+    size_t getMemoryBudget() const;
+    void setEvictionCallback(EvictionCallback callback); // must not modify the tree
+
+    // Thread safety: several const methods write internal state, so const calls may not
+    // run concurrently in general. lower_bound and the hinted get move the finger;
+    // rangeSum/rangeMin/rangeMax, findOverlapping, isValid and copying from the tree
+    // re-aggregate paths written through operator[]; with a budget set, get/contains/
+    // lower_bound also set the CLOCK bit. Only get/contains without a budget, findRange,
+    // keys, size and the height/memory getters are pure reads.
+
     friend ostream& operator<<(ostream& os, const AVLTree& avlTree);
 
 
 protected:
+    // sum/min/max of every value in a node's subtree
+    struct SubtreeAggregate {
+        size_t sum;
+        size_t min;
+        size_t max;
+    };
+
     class AVLNode {
     public:
         KeyType key;
         ValueType value;
         size_t height;
+        bool referenced; // CLOCK bit: used since the eviction hand last passed
+
+        // nullptr unless aggregates are enabled
+        SubtreeAggregate* aggregate;
 
         AVLNode* left;
         AVLNode* right;
+        AVLNode* parent; // nullptr for root, kept by updateNode() and the rotations
 
         // 0, 1 or 2
         size_t numChildren() const;
@@ -55,19 +140,83 @@ protected:
         size_t getHeight() const;
 
         // Constructors:
-        AVLNode() : key(), value(0), height(1), left(nullptr), right(nullptr) {}
+        AVLNode() : key(), value(0), height(1), referenced(false),
+        aggregate(nullptr), left(nullptr), right(nullptr), parent(nullptr) {}
         AVLNode(const KeyType& k, const ValueType& v) :
-        key(k), value(v), height(1), left(nullptr), right(nullptr) {}
+        key(k), value(v), height(1), referenced(false),
+        aggregate(nullptr), left(nullptr), right(nullptr), parent(nullptr) {}
 
         AVLNode(const KeyType& k, const ValueType& v, size_t h, AVLNode* l, AVLNode* r) :
-        key(k), value(v), height(1), left(l), right(r) {}
+        key(k), value(v), height(h), referenced(false),
+        aggregate(nullptr), left(l), right(r), parent(nullptr) {}
+
+        ~AVLNode() { delete aggregate; }
+        // owns aggregate, a copy would delete it twice
+        AVLNode(const AVLNode&) = delete;
+        AVLNode& operator=(const AVLNode&) = delete;
 
     };
 
+    // Open addressing (linear probing) map from key to the node holding it.
+    // Stores the hash next to the pointer so probes rarely touch the key.
+    class HashIndex {
+    public:
+        HashIndex();
+
+        AVLNode* find(const KeyType& key) const;
+        // map node->key to node, replacing any existing entry for that key
+        void put(AVLNode* node);
+        // drop key, but only if it still maps to node; halves the table when it gets sparse
+        void erase(const KeyType& key, const AVLNode* node);
+        // rehash into the smallest table that holds the current entries
+        void compact();
+
+        size_t size() const;
+        size_t bytes() const;
+
+    private:
+        struct Slot {
+            size_t hash;
+            AVLNode* node; // nullptr = empty slot
+        };
+
+        vector<Slot> slots; // size is always a power of two
+        size_t count;
+
+        size_t findSlot(const KeyType& key, size_t hash) const; // slot holding key or the empty slot ending its probe
+        void rehash(size_t newSize);
+    };
+
 private:
     AVLNode* root;
     size_t treeSize; // private member variable for O(1) size
 
+    // operator[] hands out a reference, so the value can change after we return.
+    // Every such key is remembered here and its path re-aggregated before the next
+    // aggregate query. Past max(size(), 16) keys the whole tree is redone instead.
+    mutable vector<KeyType> dirtyKeys;
+    mutable bool allDirty;
+
+    bool trackAggregates; // enableAggregates() was called, new nodes get a SubtreeAggregate
+
+    HashIndex* hashIndex; // nullptr unless enableHashIndex() was called
+
+    // last-access cursor for the hinted operations, nullptr when unknown
+    mutable AVLNode* finger;
+
+    size_t memoryBytes;  // nodes + heap key storage, kept up to date on every alloc/free
+    size_t memoryBudget; // 0 = unlimited
+    EvictionCallback evictionCallback;
+    optional<KeyType> clockHand; // key the CLOCK sweep resumes at
+
+    // running result of a range aggregate query
+    struct Aggregate {
+        bool empty = true;
+        ValueType sum = 0;
+        ValueType min = 0;
+        ValueType max = 0;
+    };
+
     // helpers for insert and remove
     bool insertNode(AVLNode*& current, const KeyType& key, const ValueType& value);
     // this overloaded remove will do the recursion to remove the node
@@ -83,6 +232,28 @@ private:
 
     // helper for heights
     int getNodeHeight(AVLNode* node) const;
+    // recompute height, subtree aggregates and the children's parent pointers
+    void updateNode(AVLNode* node) const;
+
+    // finger helpers
+    AVLNode* fingerStart(const KeyType& hint, const KeyType& key, AVLNode*& bound) const;
+    AVLNode* climbToward(AVLNode* start, const KeyType& key, AVLNode*& bound) const;
+    optional<KeyType> lowerBoundFrom(AVLNode* node, AVLNode* bound, const KeyType& key) const;
+    AVLNode* lowerBoundNode(AVLNode* node, AVLNode* bound, const KeyType& key) const;
+    AVLNode*& linkOf(AVLNode* node); // parent's child pointer (or root) that holds node
+    // update and rebalance node and its ancestors; with aggregates off it stops at the
+    // first one whose height comes out unchanged, with them on it goes to the root
+    void rebalanceUp(AVLNode* node);
+
+    // aggregate helpers
+    void aggregateRange(AVLNode* node, const KeyType& lowKey, const KeyType& highKey,
+                        bool checkLow, bool checkHigh, Aggregate& acc) const;
+    void refreshPath(AVLNode* node, const KeyType& key) const;
+    void refreshAll(AVLNode* node) const; // re-aggregate the whole subtree bottom-up
+    void findOverlappingHelper(AVLNode* node, const KeyType& highKey, const ValueType& lowValue,
+                               vector<KeyType>& res) const;
+    void flushDirty() const;
+    void setAggregates(AVLNode* node, bool enable); // add/drop SubtreeAggregates bottom-up
 
     // node finding helpers
     bool containsNode(AVLNode* node, const KeyType& key) const;
@@ -96,6 +267,20 @@ private:
     // copy and destroy helpers
     void searchAndDestroy(AVLNode* node); // (get it? Like Metallica >.<)  helper: finds node and deletes it
     AVLNode* deepCopy(AVLNode* node);
+
+    // hash index helper: add every node of the subtree
+    void indexNodes(AVLNode* node);
+
+    // invariant check helper
+    bool checkNode(AVLNode* node, const KeyType* low, const KeyType* high,
+                   size_t& count, size_t& bytes) const;
+
+    // memory and eviction helpers
+    static size_t nodeBytes(const AVLNode* node);
+    void enforceBudget(AVLNode* keep); // evict until under budget, never evicting keep
+    AVLNode* clockVictim(AVLNode* keep);
+    AVLNode* successor(AVLNode* node) const;
+    void markUsed(AVLNode* node) const; // set the CLOCK bit if a budget is active
 };
 
 #endif //AVLTREE_H
@@ -0,0 +1,224 @@
+/*
+Benchmarks for the AVL Tree
+Point lookups (get/contains) with and without the hash index, plus the
+memory the index adds on top of the tree, after a bulk load and after a
+remove-heavy phase.
+Inserts, lower_bound and get from root vs from the finger (previous key as
+hint) for sequential, near-sequential and random key orders.
+
+Usage: AVLTreeBench [seed]
+ */
+#include "AVLTree.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+using namespace std;
+
+using Clock = chrono::steady_clock;
+
+// keys look like the ids we store: a prefix plus a zero padded number
+string makeKey(size_t n) {
+    string digits = to_string(n);
+    return "session:" + string(12 - min<size_t>(12, digits.size()), '0') + digits;
+}
+
+double nsPerOp(Clock::time_point start, size_t ops) {
+    return chrono::duration<double, nano>(Clock::now() - start).count() / double(ops);
+}
+
+// 90% hits, 10% misses, same probe list for both runs
+vector<string> makeProbes(mt19937_64& rng, size_t treeKeys, size_t count) {
+    vector<string> probes;
+    for (size_t i = 0; i < count; i++) {
+        bool hit = rng() % 10 != 0;
+        probes.push_back(makeKey(hit ? rng() % treeKeys : treeKeys + rng() % treeKeys));
+    }
+    return probes;
+}
+
+double timeLookups(const AVLTree& tree, const vector<string>& probes) {
+    size_t found = 0;
+    auto start = Clock::now();
+    for (const string& key : probes) {
+        optional<size_t> value = tree.get(key);
+        found += value.has_value();
+        found += tree.contains(key);
+    }
+    double ns = nsPerOp(start, probes.size() * 2);
+    if (found == 0) {
+        cout << "(no hits)" << endl; // keep the loop from being optimized away
+    }
+    return ns;
+}
+
+void lookupBench(mt19937_64& rng, size_t treeKeys) {
+    AVLTree tree;
+    vector<size_t> order(treeKeys);
+    for (size_t i = 0; i < treeKeys; i++) {
+        order[i] = i;
+    }
+    shuffle(order.begin(), order.end(), rng);
+    for (size_t n : order) {
+        tree.insert(makeKey(n), n);
+    }
+
+    vector<string> probes = makeProbes(rng, treeKeys, 1000000);
+
+    double plain = timeLookups(tree, probes);
+    tree.enableHashIndex();
+    double indexed = timeLookups(tree, probes);
+
+    size_t indexBytes = tree.hashIndexBytes();
+    cout << setw(9) << treeKeys
+         << setw(12) << fixed << setprecision(1) << plain
+         << setw(12) << indexed
+         << setw(9) << setprecision(2) << plain / indexed << "x"
+         << setw(13) << indexBytes
+         << setw(12) << setprecision(1) << double(indexBytes) / double(treeKeys) << endl;
+}
+
+// Index footprint once most keys are gone again: the table shrinks with the tree
+void removeHeavyBench(mt19937_64& rng, size_t treeKeys) {
+    AVLTree tree;
+    tree.enableHashIndex();
+    vector<size_t> order(treeKeys);
+    for (size_t i = 0; i < treeKeys; i++) {
+        order[i] = i;
+        tree.insert(makeKey(i), i);
+    }
+    size_t peakBytes = tree.hashIndexBytes();
+
+    shuffle(order.begin(), order.end(), rng);
+    for (size_t i = 0; i < treeKeys - treeKeys / 10; i++) {
+        tree.remove(makeKey(order[i]));
+    }
+
+    vector<string> probes = makeProbes(rng, treeKeys, 1000000);
+    double indexed = timeLookups(tree, probes);
+
+    size_t indexBytes = tree.hashIndexBytes();
+    cout << setw(9) << treeKeys << setw(9) << tree.size()
+         << setw(13) << peakBytes << setw(13) << indexBytes
+         << setw(12) << fixed << setprecision(1) << double(indexBytes) / double(tree.size())
+         << setw(12) << indexed << endl;
+}
+
+// FINGER----------------------------------------------------------------------
+
+// key orders: ascending, ascending with each window of 16 shuffled, random
+vector<vector<size_t>> makeOrders(mt19937_64& rng, size_t count) {
+    vector<size_t> sequential(count);
+    for (size_t i = 0; i < count; i++) {
+        sequential[i] = i;
+    }
+    vector<size_t> nearSequential = sequential;
+    for (size_t i = 0; i < count; i += 16) {
+        shuffle(nearSequential.begin() + i, nearSequential.begin() + min(count, i + 16), rng);
+    }
+    vector<size_t> random = sequential;
+    shuffle(random.begin(), random.end(), rng);
+    return {sequential, nearSequential, random};
+}
+
+void fingerBench(mt19937_64& rng, size_t count) {
+    const char* names[] = {"sequential", "near-sequential", "random"};
+    vector<vector<size_t>> orders = makeOrders(rng, count);
+
+    cout << "insert, lower_bound then get, " << count << " keys (ns/op)" << endl;
+    cout << setw(16) << "pattern" << setw(12) << "insert" << setw(12) << "hinted"
+         << setw(12) << "lower_bound" << setw(12) << "hinted"
+         << setw(12) << "get" << setw(12) << "hinted" << endl;
+
+    for (size_t pattern = 0; pattern < orders.size(); pattern++) {
+        vector<string> keys;
+        for (size_t n : orders[pattern]) {
+            keys.push_back(makeKey(n));
+        }
+
+        AVLTree plain;
+        auto start = Clock::now();
+        for (const string& key : keys) {
+            plain.insert(key, 0);
+        }
+        double plainInsert = nsPerOp(start, count);
+
+        AVLTree hinted;
+        string last;
+        start = Clock::now();
+        for (const string& key : keys) {
+            hinted.insert(last, key, 0);
+            last = key;
+        }
+        double hintedInsert = nsPerOp(start, count);
+
+        // look up the same order again, each probe just past the key it names
+        size_t found = 0;
+        start = Clock::now();
+        for (const string& key : keys) {
+            found += plain.lower_bound(key + "!").has_value();
+        }
+        double plainLower = nsPerOp(start, count);
+
+        last = "";
+        start = Clock::now();
+        for (const string& key : keys) {
+            optional<string> next = hinted.lower_bound(last, key + "!");
+            found += next.has_value();
+            if (next) {
+                last = *next;
+            }
+        }
+        double hintedLower = nsPerOp(start, count);
+
+        start = Clock::now();
+        for (const string& key : keys) {
+            found += plain.get(key).has_value();
+        }
+        double plainGet = nsPerOp(start, count);
+
+        last = "";
+        start = Clock::now();
+        for (const string& key : keys) {
+            found += hinted.get(last, key).has_value();
+            last = key;
+        }
+        double hintedGet = nsPerOp(start, count);
+
+        if (found == 0 || plain.size() != hinted.size()) {
+            cout << "(mismatch)" << endl;
+        }
+        cout << setw(16) << names[pattern] << fixed << setprecision(1)
+             << setw(12) << plainInsert << setw(12) << hintedInsert
+             << setw(12) << plainLower << setw(12) << hintedLower
+             << setw(12) << plainGet << setw(12) << hintedGet << endl;
+    }
+}
+
+int main(int argc, char* argv[]) {
+    unsigned long long seed = argc > 1 ? strtoull(argv[1], nullptr, 10) : 3100;
+    mt19937_64 rng(seed);
+
+    cout << "point lookups, 90% hits (ns/op), index memory" << endl;
+    cout << setw(9) << "keys" << setw(12) << "tree" << setw(12) << "indexed"
+         << setw(10) << "speedup" << setw(13) << "index bytes" << setw(12) << "bytes/key" << endl;
+    for (size_t treeKeys : {1000, 10000, 100000, 1000000}) {
+        lookupBench(rng, treeKeys);
+    }
+    cout << endl;
+
+    cout << "index memory after removing 90% of keys" << endl;
+    cout << setw(9) << "loaded" << setw(9) << "left" << setw(13) << "peak bytes"
+         << setw(13) << "index bytes" << setw(12) << "bytes/key" << setw(12) << "ns/op" << endl;
+    for (size_t treeKeys : {10000, 100000, 1000000}) {
+        removeHeavyBench(rng, treeKeys);
+    }
+    cout << endl;
+
+    fingerBench(rng, 1000000);
+    return 0;
+}
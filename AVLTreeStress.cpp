@@ -0,0 +1,594 @@
+/*
+Stress harness for the AVL Tree
+Runs deterministic random and adversarial operation sequences against a
+std::map oracle and checks the tree after every step:
+  - AVLTree::isValid(): ordering, stored heights, AVL balance, aggregates (when
+    enabled), size()
+  - contents: size(), keys(), get(), contains(), findRange(), range aggregates
+    and findOverlapping()
+The random phases run both with and without the hash index, the finger phase
+drives the hinted insert/lower_bound/get on a random walk, and the budget phases
+check memoryUsage() stays under a changing budget with evictions mirrored
+into the oracle (checking contents without touching CLOCK bits) and that
+touched entries outlive cold ones. isValid() also recounts memoryUsage() from the nodes.
+Then times each operation kind and prints latency percentiles.
+
+Usage: AVLTreeStress [seed]
+Exits with 1 on the first mismatch.
+ */
+#include "AVLTree.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+using namespace std;
+
+using Oracle = map<string, size_t>;
+
+// fixed width keys so string order matches numeric order
+string makeKey(size_t n) {
+    string digits = to_string(n);
+    return string(8 - min<size_t>(8, digits.size()), '0') + digits;
+}
+
+void fail(const string& phase, size_t step, const string& what) {
+    cout << "FAIL [" << phase << "] step " << step << ": " << what << endl;
+    exit(1);
+}
+
+// Compare every observable of the tree against the oracle.
+// touchFree sticks to calls that leave the CLOCK bits alone (no get/contains),
+// so budget phases can check contents without making every entry hot.
+void checkTree(const AVLTree& tree, const Oracle& oracle, mt19937_64& rng,
+               const string& phase, size_t step, bool touchFree = false) {
+    if (!tree.isValid()) {
+        fail(phase, step, "invariant check failed");
+    }
+    if (tree.size() != oracle.size()) {
+        fail(phase, step, "size " + to_string(tree.size()) + " != " + to_string(oracle.size()));
+    }
+
+    vector<string> keys = tree.keys();
+    if (keys.size() != oracle.size()) {
+        fail(phase, step, "keys() length mismatch");
+    }
+    vector<size_t> values = keys.empty() ? vector<size_t>() : tree.findRange(keys.front(), keys.back());
+    size_t i = 0;
+    for (const auto& [key, value] : oracle) {
+        if (keys[i] != key) {
+            fail(phase, step, "keys() order mismatch at " + key);
+        }
+        if (touchFree) {
+            if (values[i] != value) {
+                fail(phase, step, "value of " + key + " mismatch");
+            }
+        } else {
+            optional<size_t> got = tree.get(key);
+            if (!got || *got != value) {
+                fail(phase, step, "get(" + key + ") mismatch");
+            }
+        }
+        i++;
+    }
+
+    // a few random probes, mostly misses
+    for (int probe = 0; probe < 4 && !touchFree; probe++) {
+        string key = makeKey(rng() % 4096);
+        if (tree.contains(key) != (oracle.count(key) == 1)) {
+            fail(phase, step, "contains(" + key + ") mismatch");
+        }
+    }
+
+    // random range
+    string low = makeKey(rng() % 4096);
+    string high = makeKey(rng() % 4096);
+    if (high < low) {
+        swap(low, high);
+    }
+    vector<size_t> expected;
+    size_t sum = 0;
+    optional<size_t> lowest, highest;
+    for (auto it = oracle.lower_bound(low); it != oracle.end() && it->first <= high; ++it) {
+        expected.push_back(it->second);
+        sum += it->second;
+        lowest = lowest ? min(*lowest, it->second) : it->second;
+        highest = highest ? max(*highest, it->second) : it->second;
+    }
+    if (tree.findRange(low, high) != expected) {
+        fail(phase, step, "findRange(" + low + ", " + high + ") mismatch");
+    }
+    if (tree.rangeSum(low, high) != sum || tree.rangeMin(low, high) != lowest ||
+        tree.rangeMax(low, high) != highest) {
+        fail(phase, step, "range aggregate (" + low + ", " + high + ") mismatch");
+    }
+
+    // values as interval ends: every key <= high whose value reaches lowValue
+    size_t lowValue = rng() % 1000;
+    vector<string> overlapping;
+    for (auto it = oracle.begin(); it != oracle.end() && it->first <= high; ++it) {
+        if (it->second >= lowValue) {
+            overlapping.push_back(it->first);
+        }
+    }
+    if (tree.findOverlapping(high, lowValue) != overlapping) {
+        fail(phase, step, "findOverlapping(" + high + ", " + to_string(lowValue) + ") mismatch");
+    }
+}
+
+// Operations that return a result are checked against the oracle right away
+void doInsert(AVLTree& tree, Oracle& oracle, const string& key, size_t value,
+              const string& phase, size_t step) {
+    bool expected = oracle.emplace(key, value).second;
+    if (tree.insert(key, value) != expected) {
+        fail(phase, step, "insert(" + key + ") return value");
+    }
+}
+
+void doRemove(AVLTree& tree, Oracle& oracle, const string& key,
+              const string& phase, size_t step) {
+    bool expected = oracle.erase(key) == 1;
+    if (tree.remove(key) != expected) {
+        fail(phase, step, "remove(" + key + ") return value");
+    }
+}
+
+void doBracket(AVLTree& tree, Oracle& oracle, const string& key, size_t value) {
+    tree[key] += value;
+    oracle[key] += value;
+}
+
+// hold several operator[] references across an insert, then write through them
+// oldest first: every write has to reach the aggregates, not just the last key's.
+// Now and then hold more than the tree has keys so the whole-tree refresh runs.
+void doHeldBrackets(AVLTree& tree, Oracle& oracle, mt19937_64& rng, size_t keySpace,
+                    const string& phase, size_t step) {
+    vector<pair<size_t*, string>> held;
+    size_t count = step % 500 == 1 ? tree.size() + 20 : 2 + rng() % 3;
+    for (size_t i = 0; i < count; i++) {
+        string key = makeKey(rng() % keySpace);
+        held.push_back({&tree[key], key});
+        oracle[key] += 0; // operator[] inserts a missing key as 0
+    }
+    doInsert(tree, oracle, makeKey(rng() % keySpace), rng() % 1000, phase, step);
+    for (auto& [value, key] : held) {
+        size_t written = rng() % 1000;
+        *value = written;
+        oracle[key] = written;
+    }
+}
+
+// PHASES-----------------------------------------------------------------------
+
+void randomPhase(mt19937_64& rng, size_t steps, size_t keySpace, bool indexed, bool aggregated) {
+    const string phase = string(indexed ? "random/indexed" : "random") + (aggregated ? "/aggregated" : "");
+    AVLTree tree;
+    Oracle oracle;
+    if (indexed) {
+        tree.enableHashIndex();
+    }
+    if (aggregated) {
+        tree.enableAggregates();
+    }
+    for (size_t step = 0; step < steps; step++) {
+        string key = makeKey(rng() % keySpace);
+        size_t value = rng() % 1000;
+        switch (rng() % 8) {
+            case 0: case 1: case 2:
+                doInsert(tree, oracle, key, value, phase, step);
+                break;
+            case 3: case 4:
+                doRemove(tree, oracle, key, phase, step);
+                break;
+            case 5:
+                if (step % 2 == 0) {
+                    doBracket(tree, oracle, key, value);
+                } else {
+                    doHeldBrackets(tree, oracle, rng, keySpace, phase, step);
+                }
+                break;
+            case 6: {
+                // copy and assignment must produce independent, valid trees
+                AVLTree copy(tree);
+                AVLTree assigned;
+                assigned.insert(makeKey(0), 0);
+                assigned = copy;
+                copy.insert(makeKey(4095), 1);
+                if (assigned.hasHashIndex() != indexed || assigned.hasAggregates() != tree.hasAggregates()) {
+                    fail(phase, step, "copy lost hash index or aggregate setting");
+                }
+                checkTree(assigned, oracle, rng, phase + "/copy", step);
+                break;
+            }
+            case 7:
+                // rebuilding the index from the tree must give the same answers
+                if (indexed && step % 1000 == 0) {
+                    tree.disableHashIndex();
+                    checkTree(tree, oracle, rng, phase + "/unindexed", step);
+                    tree.enableHashIndex();
+                }
+                // aggregates can be switched on and off on a populated tree
+                if (step % 1000 == 500) {
+                    if (tree.hasAggregates()) {
+                        tree.disableAggregates();
+                    } else {
+                        tree.enableAggregates();
+                    }
+                }
+                break;
+            default:
+                break; // check only
+        }
+        checkTree(tree, oracle, rng, phase, step);
+    }
+}
+
+// Hinted operations on a random walk through the key space, with removes and
+// far hints mixed in so the search now and then has to find the hint first
+void fingerPhase(mt19937_64& rng, size_t steps, size_t keySpace, bool indexed, bool aggregated) {
+    const string phase = string(indexed ? "finger/indexed" : "finger") + (aggregated ? "/aggregated" : "");
+    AVLTree tree;
+    Oracle oracle;
+    if (indexed) {
+        tree.enableHashIndex(); // hints found through the index
+    }
+    if (aggregated) {
+        tree.enableAggregates();
+    }
+    size_t position = keySpace / 2;
+    string last = makeKey(position);
+
+    for (size_t step = 0; step < steps; step++) {
+        // move up to 8 keys either way
+        position = (position + keySpace + rng() % 17 - 8) % keySpace;
+        string key = makeKey(position);
+        string hint = rng() % 16 == 0 ? makeKey(rng() % keySpace) : last;
+
+        switch (rng() % 7) {
+            case 0: case 1: case 2: {
+                bool expected = oracle.emplace(key, position).second;
+                if (tree.insert(hint, key, position) != expected) {
+                    fail(phase, step, "insert(" + hint + ", " + key + ") return value");
+                }
+                last = key;
+                break;
+            }
+            case 3: case 4: {
+                auto it = oracle.lower_bound(key);
+                optional<string> expected;
+                if (it != oracle.end()) {
+                    expected = it->first;
+                    last = it->first;
+                }
+                if (tree.lower_bound(hint, key) != expected || tree.lower_bound(key) != expected) {
+                    fail(phase, step, "lower_bound(" + hint + ", " + key + ") mismatch");
+                }
+                break;
+            }
+            case 5: {
+                auto it = oracle.find(key);
+                optional<size_t> expected;
+                if (it != oracle.end()) {
+                    expected = it->second;
+                    last = key;
+                }
+                if (tree.get(hint, key) != expected) {
+                    fail(phase, step, "get(" + hint + ", " + key + ") mismatch");
+                }
+                break;
+            }
+            default:
+                doRemove(tree, oracle, key, phase, step);
+                break;
+        }
+        checkTree(tree, oracle, rng, phase, step);
+    }
+}
+
+// Random operations under a memory budget. Evictions are mirrored into the oracle
+// through the callback, which also checks the evicted entry was really there.
+void budgetPhase(mt19937_64& rng, size_t steps, size_t keySpace, bool indexed) {
+    const string phase = indexed ? "budget/indexed" : "budget";
+    AVLTree tree;
+    Oracle oracle;
+    size_t evictions = 0;
+    size_t step = 0;
+    if (indexed) {
+        // aggregates add to every node's footprint, cover that accounting too
+        tree.enableHashIndex();
+        tree.enableAggregates();
+    }
+    tree.setEvictionCallback([&](const string& key, const size_t& value) {
+        auto it = oracle.find(key);
+        if (it == oracle.end() || it->second != value) {
+            fail(phase, step, "evicted entry " + key + " not in oracle");
+        }
+        oracle.erase(it);
+        evictions++;
+    });
+    tree.setMemoryBudget(16 * 1024);
+
+    string last;
+    for (; step < steps; step++) {
+        // half the keys are long enough to need heap storage
+        string key = makeKey(rng() % keySpace);
+        if (rng() % 2 == 0) {
+            key += string(40, 'x');
+        }
+        size_t value = rng() % 1000;
+
+        switch (rng() % 8) {
+            case 0: case 1:
+                doInsert(tree, oracle, key, value, phase, step);
+                break;
+            case 2: {
+                bool expected = oracle.emplace(key, value).second;
+                if (tree.insert(last, key, value) != expected) {
+                    fail(phase, step, "hinted insert(" + key + ") return value");
+                }
+                last = key;
+                break;
+            }
+            case 3:
+                doBracket(tree, oracle, key, value);
+                break;
+            case 4:
+                doRemove(tree, oracle, key, phase, step);
+                break;
+            case 5:
+                // touch an entry so the sweep keeps it
+                tree.get(key);
+                break;
+            case 6:
+                // budget changes take effect right away
+                tree.setMemoryBudget((4 + rng() % 28) * 1024);
+                break;
+            default:
+                break; // check only
+        }
+
+        // budgets here are far above one entry, so eviction must always get under
+        if (tree.memoryUsage() > tree.getMemoryBudget()) {
+            fail(phase, step, "over budget: " + to_string(tree.memoryUsage()) + " > " +
+                              to_string(tree.getMemoryBudget()));
+        }
+        checkTree(tree, oracle, rng, phase, step, true);
+    }
+
+    if (evictions == 0) {
+        fail(phase, step, "budget never evicted anything");
+    }
+}
+
+// CLOCK must prefer cold entries: touch every other entry, then cut the budget
+// to about 60% and check only untouched entries were evicted
+void coldEvictionPhase(mt19937_64& rng, bool indexed) {
+    const string phase = indexed ? "budget/cold-first/indexed" : "budget/cold-first";
+    AVLTree tree;
+    Oracle oracle;
+    size_t evictions = 0;
+    if (indexed) {
+        tree.enableHashIndex();
+    }
+    tree.setEvictionCallback([&](const string& key, const size_t& value) {
+        if (value % 2 == 0) {
+            fail(phase, evictions, "evicted touched entry " + key);
+        }
+        oracle.erase(key);
+        evictions++;
+    });
+
+    // shuffled so victims have two children as often as not
+    vector<size_t> order(100);
+    for (size_t n = 0; n < order.size(); n++) {
+        order[n] = n;
+    }
+    shuffle(order.begin(), order.end(), rng);
+    for (size_t n : order) {
+        doInsert(tree, oracle, makeKey(n), n, phase, n);
+    }
+
+    // CLOCK bits are only kept while a budget is set
+    tree.setMemoryBudget(tree.memoryUsage() * 2);
+    for (size_t n = 0; n < order.size(); n += 2) {
+        tree.get(makeKey(n));
+    }
+
+    tree.setMemoryBudget(tree.memoryUsage() * 6 / 10);
+    if (evictions == 0 || tree.memoryUsage() > tree.getMemoryBudget()) {
+        fail(phase, 0, "budget cut evicted " + to_string(evictions) + " entries");
+    }
+    checkTree(tree, oracle, rng, phase, 0, true);
+}
+
+// Lower the budget after a mass remove: the index is still sized for the peak,
+// it has to be shrunk instead of evicting entries that fit on their own.
+// A budget nothing can meet still caps the tree.
+void budgetAfterRemovePhase(mt19937_64& rng) {
+    const string phase = "budget/after-remove";
+    AVLTree tree;
+    Oracle oracle;
+    size_t evictions = 0;
+    tree.enableHashIndex();
+    tree.setEvictionCallback([&](const string& key, const size_t&) {
+        oracle.erase(key);
+        evictions++;
+    });
+
+    for (size_t n = 0; n < 2000; n++) {
+        doInsert(tree, oracle, makeKey(n), n, phase, n);
+    }
+    for (size_t n = 0; n < 1900; n++) {
+        doRemove(tree, oracle, makeKey(n), phase, n);
+    }
+
+    tree.setMemoryBudget(32 * 1024);
+    if (evictions != 0 || tree.size() != 100) {
+        fail(phase, 0, to_string(evictions) + " entries evicted although 100 fit");
+    }
+    if (tree.memoryUsage() > tree.getMemoryBudget()) {
+        fail(phase, 0, "over budget: " + to_string(tree.memoryUsage()));
+    }
+    checkTree(tree, oracle, rng, phase, 0, true);
+
+    // tighter budget: evict some, but only until it fits
+    tree.setMemoryBudget(4 * 1024);
+    if (evictions == 0 || tree.size() == 0 || tree.memoryUsage() > tree.getMemoryBudget()) {
+        fail(phase, 1, "4K budget: size " + to_string(tree.size()) +
+                       ", usage " + to_string(tree.memoryUsage()));
+    }
+    checkTree(tree, oracle, rng, phase, 1, true);
+
+    // below an empty index: can't be met, but the cap still holds the tree down to
+    // the one entry just inserted
+    tree.setMemoryBudget(64);
+    if (tree.size() != 0) {
+        fail(phase, 2, "budget below the index floor kept " + to_string(tree.size()) + " entries");
+    }
+    checkTree(tree, oracle, rng, phase, 2, true);
+    for (size_t n = 0; n < 1000; n++) {
+        doInsert(tree, oracle, makeKey(n), n, phase, n);
+        if (tree.size() != 1) {
+            fail(phase, 3 + n, "tiny budget let the tree grow to " + to_string(tree.size()));
+        }
+    }
+    checkTree(tree, oracle, rng, phase, 3, true);
+}
+
+// Insert a whole key order, then remove it in another order
+void orderPhase(mt19937_64& rng, const string& phase,
+                const vector<size_t>& insertOrder, const vector<size_t>& removeOrder) {
+    AVLTree tree;
+    Oracle oracle;
+    size_t step = 0;
+    for (size_t n : insertOrder) {
+        doInsert(tree, oracle, makeKey(n), n, phase + "/insert", step++);
+        checkTree(tree, oracle, rng, phase + "/insert", step);
+    }
+    for (size_t n : removeOrder) {
+        doRemove(tree, oracle, makeKey(n), phase + "/remove", step++);
+        checkTree(tree, oracle, rng, phase + "/remove", step);
+    }
+    if (tree.size() != 0 || tree.getHeight() != 0) {
+        fail(phase, step, "tree not empty after removing everything");
+    }
+}
+
+void adversarialPhases(mt19937_64& rng, size_t count) {
+    vector<size_t> ascending(count), descending, zigzag, shuffled;
+    for (size_t i = 0; i < count; i++) {
+        ascending[i] = i;
+    }
+    descending.assign(ascending.rbegin(), ascending.rend());
+    // 0, n-1, 1, n-2, ... pulls both spines at once
+    for (size_t lo = 0, hi = count; lo < hi;) {
+        zigzag.push_back(lo++);
+        if (lo < hi) {
+            zigzag.push_back(--hi);
+        }
+    }
+    shuffled = ascending;
+    shuffle(shuffled.begin(), shuffled.end(), rng);
+
+    orderPhase(rng, "ascending", ascending, ascending);
+    orderPhase(rng, "descending", descending, ascending);
+    orderPhase(rng, "zigzag", zigzag, descending);
+    orderPhase(rng, "shuffled", shuffled, zigzag);
+
+    // churn one key next to a full tree (hits the two-children remove case at the root)
+    AVLTree tree;
+    Oracle oracle;
+    for (size_t n : shuffled) {
+        doInsert(tree, oracle, makeKey(n), n, "churn", n);
+    }
+    for (size_t step = 0; step < count; step++) {
+        string key = tree.keys()[tree.size() / 2];
+        doRemove(tree, oracle, key, "churn", step);
+        doInsert(tree, oracle, key, step, "churn", step);
+        doBracket(tree, oracle, makeKey(count + step % 7), 1);
+        checkTree(tree, oracle, rng, "churn", step);
+    }
+}
+
+// LATENCY----------------------------------------------------------------------
+
+void report(const string& name, vector<long long>& samples) {
+    sort(samples.begin(), samples.end());
+    auto pct = [&](double p) {
+        return samples[min(samples.size() - 1, size_t(p * samples.size()))];
+    };
+    cout << "  " << name << ": n=" << samples.size()
+         << " p50=" << pct(0.50) << "ns p90=" << pct(0.90)
+         << "ns p99=" << pct(0.99) << "ns max=" << samples.back() << "ns" << endl;
+}
+
+void latencyPhase(mt19937_64& rng, size_t count) {
+    using Clock = chrono::steady_clock;
+    vector<long long> inserts, gets, ranges, removes;
+
+    vector<string> keys;
+    for (size_t i = 0; i < count; i++) {
+        keys.push_back(makeKey(rng() % (count * 4)) + "-" + to_string(i));
+    }
+
+    AVLTree tree;
+    tree.enableAggregates(); // rangeSum below in O(log n)
+    auto time = [&](vector<long long>& samples, auto&& op) {
+        auto start = Clock::now();
+        op();
+        samples.push_back(chrono::duration_cast<chrono::nanoseconds>(Clock::now() - start).count());
+    };
+
+    for (const string& key : keys) {
+        time(inserts, [&] { tree.insert(key, key.size()); });
+    }
+    for (size_t i = 0; i < count; i++) {
+        const string& key = keys[rng() % count];
+        time(gets, [&] { volatile bool found = tree.get(key).has_value(); (void)found; });
+    }
+    for (size_t i = 0; i < count / 10; i++) {
+        string low = makeKey(rng() % (count * 4));
+        string high = makeKey(rng() % (count * 4));
+        if (high < low) {
+            swap(low, high);
+        }
+        time(ranges, [&] { volatile size_t sum = tree.rangeSum(low, high); (void)sum; });
+    }
+    shuffle(keys.begin(), keys.end(), rng);
+    for (const string& key : keys) {
+        time(removes, [&] { tree.remove(key); });
+    }
+
+    cout << "latency (" << count << " keys):" << endl;
+    report("insert", inserts);
+    report("get", gets);
+    report("rangeSum", ranges);
+    report("remove", removes);
+}
+
+int main(int argc, char* argv[]) {
+    unsigned long long seed = argc > 1 ? strtoull(argv[1], nullptr, 10) : 3100;
+    cout << "seed " << seed << endl;
+    mt19937_64 rng(seed);
+
+    for (bool indexed : {false, true}) {
+        randomPhase(rng, 20000, 64, indexed, false);  // dense: lots of hits and rebalancing on remove
+        randomPhase(rng, 20000, 1024, indexed, true); // sparse: deeper tree, mostly inserts
+    }
+    fingerPhase(rng, 20000, 512, false, false);
+    fingerPhase(rng, 20000, 512, false, true);
+    fingerPhase(rng, 20000, 512, true, false);
+    budgetPhase(rng, 20000, 1024, false);
+    budgetPhase(rng, 20000, 1024, true);
+    budgetAfterRemovePhase(rng);
+    coldEvictionPhase(rng, false);
+    coldEvictionPhase(rng, true);
+    adversarialPhases(rng, 512);
+    cout << "all invariant checks passed" << endl;
+
+    latencyPhase(rng, 200000);
+    return 0;
+}